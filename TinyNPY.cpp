@@ -8,11 +8,38 @@
 #include "TinyNPY.h"
 #include <regex>
 #include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <random>
+#include <fstream>
+#include <sstream>
 #include <zlib.h>
+#ifndef _WIN32
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#else
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#endif
 
 
 // D E F I N E S ///////////////////////////////////////////////////
 
+// room reserved in a new NPY header for the first axis length to grow (same as numpy)
+#define GROWTH_AXIS_MAX_DIGITS ((size_t)21)
+
 
 // S T R U C T S ///////////////////////////////////////////////////
 
@@ -32,6 +59,93 @@ protected:
 typedef class TScopeExitRun<> ScopeExitRun;
 /*----------------------------------------------------------------*/
 
+// folder of the given file path, including the trailing separator
+static std::string GetFolder(const std::string& path)
+{
+	const size_t pos = path.find_last_of("/\\");
+	return pos == std::string::npos ? std::string() : path.substr(0, pos+1);
+}
+/*----------------------------------------------------------------*/
+
+
+// Pool of worker threads executing the asynchronous I/O requests
+// in the order they are submitted
+class IOThreadPool
+{
+public:
+	typedef std::function<void()> Task;
+
+	IOThreadPool(unsigned numThreads) : bStop(false) {
+		for (unsigned i = 0; i < numThreads; ++i)
+			threads.emplace_back(&IOThreadPool::Run, this);
+	}
+	~IOThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			bStop = true;
+		}
+		cv.notify_all();
+		for (std::thread& thread: threads)
+			thread.join();
+	}
+
+	void Enqueue(Task task) {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			tasks.emplace_back(std::move(task));
+		}
+		cv.notify_one();
+	}
+
+	template <typename Functor>
+	std::future<LPCSTR> Async(Functor f) {
+		const std::shared_ptr<std::packaged_task<LPCSTR()>> task(std::make_shared<std::packaged_task<LPCSTR()>>(f));
+		std::future<LPCSTR> future(task->get_future());
+		Enqueue([task]() { (*task)(); });
+		return future;
+	}
+
+	template <typename Functor>
+	void Async(Functor f, NpyArray::callback_t callback) {
+		Enqueue([f, callback]() {
+			const LPCSTR ret = f();
+			if (callback)
+				callback(ret);
+		});
+	}
+
+	// the pool shared by all asynchronous loads, created on first use
+	static IOThreadPool& Instance() {
+		static IOThreadPool pool(std::max(2u, std::thread::hardware_concurrency()));
+		return pool;
+	}
+
+protected:
+	void Run() {
+		while (true) {
+			Task task;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				cv.wait(lock, [this]() { return bStop || !tasks.empty(); });
+				// finish the pending requests before exiting
+				if (tasks.empty())
+					return;
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+
+protected:
+	std::vector<std::thread> threads;
+	std::deque<Task> tasks;
+	std::mutex mtx;
+	std::condition_variable cv;
+	bool bStop;
+};
+/*----------------------------------------------------------------*/
+
 
 // input
 LPCSTR NpyArray::ParseHeaderNPY(const std::string& header, shape_t& shape, size_t& wordSize, char& type, bool& fortranOrder)
@@ -96,6 +210,15 @@ LPCSTR NpyArray::ParseHeaderNPY(const uint8_t* buffer, shape_t& shape, size_t& w
 	return ParseHeaderNPY(header, shape, wordSize, type, fortranOrder);
 }
 
+// size of the NPY header, including the preamble;
+// the buffer must contain at least the first 12 bytes of the header
+size_t NpyArray::SizeHeaderNPY(const uint8_t* buffer)
+{
+	if (buffer[6] > 1)
+		return 12 + ((uint32_t(buffer[11])<<24)|(uint32_t(buffer[10])<<16)|(uint32_t(buffer[9])<<8)|uint32_t(buffer[8]));
+	return 10 + ((uint16_t(buffer[9])<<8)|uint16_t(buffer[8]));
+}
+
 LPCSTR NpyArray::ParseHeaderNPY(FILE* fp, shape_t& shape, size_t& wordSize, char& type, bool& fortranOrder)
 {
 	char buffer[32];
@@ -119,11 +242,9 @@ LPCSTR NpyArray::ParseHeaderNPY(FILE* fp, shape_t& shape, size_t& wordSize, char
 	return ParseHeaderNPY(header, shape, wordSize, type, fortranOrder);
 }
 
-LPCSTR NpyArray::ParseFooterZIP(FILE* fp, uint16_t& nrecs, size_t& globalHeaderSize, size_t& globalHeaderOffset)
+LPCSTR NpyArray::ParseFooterZIP(const char* footer, uint16_t& nrecs, size_t& globalHeaderSize, size_t& globalHeaderOffset)
 {
-	char footer[32];
-	fseek(fp, -22, SEEK_END);
-	if (fread(footer, sizeof(char), 22, fp) != 22)
+	if (footer[0] != 'P' || footer[1] != 'K' || footer[2] != 0x05 || footer[3] != 0x06)
 		return "error: failed footer";
 	const uint16_t diskNo = *(uint16_t*)(footer+4); ASSERT(diskNo == 0);
 	const uint16_t diskStart = *(uint16_t*)(footer+6); ASSERT(diskStart == 0);
@@ -135,6 +256,15 @@ LPCSTR NpyArray::ParseFooterZIP(FILE* fp, uint16_t& nrecs, size_t& globalHeaderS
 	return NULL;
 }
 
+LPCSTR NpyArray::ParseFooterZIP(FILE* fp, uint16_t& nrecs, size_t& globalHeaderSize, size_t& globalHeaderOffset)
+{
+	char footer[32];
+	fseek(fp, -22, SEEK_END);
+	if (fread(footer, sizeof(char), 22, fp) != 22)
+		return "error: failed footer";
+	return ParseFooterZIP(footer, nrecs, globalHeaderSize, globalHeaderOffset);
+}
+
 LPCSTR NpyArray::LoadNPY(FILE* fp)
 {
 	Release();
@@ -160,10 +290,14 @@ LPCSTR NpyArray::LoadNPY(std::string filename)
 LPCSTR NpyArray::LoadNPZ(FILE* fp, uint32_t comprBytes, uint32_t uncomprBytes)
 {
 	std::vector<uint8_t> bufferCompr(comprBytes);
-	std::vector<uint8_t> bufferUncompr(uncomprBytes);
 	if (fread(bufferCompr.data(), 1, comprBytes, fp) != comprBytes)
 		return "error: failed fread";
+	return InflateNPZ(bufferCompr.data(), comprBytes, uncomprBytes);
+}
 
+LPCSTR NpyArray::InflateNPZ(const uint8_t* bufferCompr, uint32_t comprBytes, uint32_t uncomprBytes)
+{
+	std::vector<uint8_t> bufferUncompr(uncomprBytes);
 	z_stream d_stream;
 	d_stream.zalloc = Z_NULL;
 	d_stream.zfree = Z_NULL;
@@ -175,21 +309,36 @@ LPCSTR NpyArray::LoadNPZ(FILE* fp, uint32_t comprBytes, uint32_t uncomprBytes)
 		return "error: can not init inflate";
 
 	d_stream.avail_in = comprBytes;
-	d_stream.next_in = bufferCompr.data();
+	d_stream.next_in = const_cast<uint8_t*>(bufferCompr);
 	d_stream.avail_out = uncomprBytes;
 	d_stream.next_out = bufferUncompr.data();
 	err = inflate(&d_stream, Z_FINISH);
-	if (err != Z_STREAM_END && err != Z_OK)
+	const uLong totalOut = d_stream.total_out;
+	inflateEnd(&d_stream);
+	if (err != Z_STREAM_END || totalOut != uncomprBytes)
 		return "error: can not uncompress";
 
-	err = inflateEnd(&d_stream);
-
-	LPCSTR ret = ParseHeaderNPY(bufferUncompr.data(), shape, wordSize, type, fortranOrder);
+	// the member must hold exactly one NPY header followed by the array data
+	if (uncomprBytes < 12)
+		return "error: invalid header";
+	const size_t headerSize = SizeHeaderNPY(bufferUncompr.data());
+	if (headerSize > uncomprBytes)
+		return "error: invalid header";
+	shape_t _shape;
+	size_t _wordSize;
+	char _type;
+	bool _fortranOrder;
+	LPCSTR ret = ParseHeaderNPY(bufferUncompr.data(), _shape, _wordSize, _type, _fortranOrder);
 	if (ret != NULL)
 		return ret;
+	if (headerSize + NumValue(_shape) * _wordSize != uncomprBytes)
+		return "error: invalid header";
+	shape = _shape;
+	wordSize = _wordSize;
+	type = _type;
+	fortranOrder = _fortranOrder;
 	init();
-	const size_t offset = uncomprBytes - SizeBytes();
-	memcpy(Data(), bufferUncompr.data()+offset, SizeBytes());
+	memcpy(Data(), bufferUncompr.data()+headerSize, SizeBytes());
 	return NULL;
 }
 
@@ -229,7 +378,7 @@ LPCSTR NpyArray::LoadNPZ(std::string filename, npz_t& arrays)
 	return NULL;
 }
 
-LPCSTR NpyArray::LoadArrayNPZ(FILE* fp, std::string& varname, NpyArray& arr)
+LPCSTR NpyArray::ReadLocalHeaderZIP(FILE* fp, std::string& varname, uint16_t& comprMethod, uint32_t& comprBytes, uint32_t& uncomprBytes)
 {
 	char localHeader[32];
 	if (fread(localHeader, sizeof(char), 30, fp) != 30)
@@ -241,40 +390,519 @@ LPCSTR NpyArray::LoadArrayNPZ(FILE* fp, std::string& varname, NpyArray& arr)
 
 	// read in the variable name
 	const uint16_t lenName = *reinterpret_cast<uint16_t*>(localHeader+26);
-	std::string vname(lenName, ' ');
-	if (fread(&vname[0], sizeof(char), lenName, fp) != lenName)
+	varname.assign(lenName, ' ');
+	if (fread(&varname[0], sizeof(char), lenName, fp) != lenName)
 		return "error: failed fread";
 
 	// erase the lagging .npy        
-	vname.erase(vname.end()-4, vname.end());
+	varname.erase(varname.end()-4, varname.end());
 
 	// read in the extra field
 	const uint16_t lenExtraField = *reinterpret_cast<uint16_t*>(localHeader+28);
 	fseek(fp, lenExtraField, SEEK_CUR); // skip past the extra field
 
+	comprMethod = *reinterpret_cast<uint16_t*>(localHeader+8);
+	comprBytes = *reinterpret_cast<uint32_t*>(localHeader+18);
+	uncomprBytes = *reinterpret_cast<uint32_t*>(localHeader+22);
+	return NULL;
+}
+
+LPCSTR NpyArray::LoadArrayNPZ(FILE* fp, std::string& varname, NpyArray& arr)
+{
+	std::string vname;
+	uint16_t comprMethod;
+	uint32_t comprBytes, uncomprBytes;
+	const LPCSTR ret = ReadLocalHeaderZIP(fp, vname, comprMethod, comprBytes, uncomprBytes);
+	if (ret != NULL)
+		return ret;
+
 	if (varname.empty() || varname == vname) {
 		// read current array
 		if (varname.empty())
 			varname = vname;
-		const uint16_t comprMethod = *reinterpret_cast<uint16_t*>(localHeader+8);
 		if (comprMethod == 0)
 			return arr.LoadNPY(fp);
-		const uint32_t comprBytes = *reinterpret_cast<uint32_t*>(localHeader+18);
-		const uint32_t uncomprBytes = *reinterpret_cast<uint32_t*>(localHeader+22);
 		return arr.LoadNPZ(fp, comprBytes, uncomprBytes);
 	}
 
 	// skip current array data
-	const uint32_t size = *reinterpret_cast<uint32_t*>(localHeader+22);
-	fseek(fp, size, SEEK_CUR);
+	fseek(fp, comprBytes, SEEK_CUR);
 	return NULL;
 }
+
+std::future<LPCSTR> NpyArray::LoadNPYAsync(std::string filename)
+{
+	return IOThreadPool::Instance().Async([this, filename]() { return LoadNPY(filename); });
+}
+
+std::future<LPCSTR> NpyArray::LoadNPZAsync(std::string filename, std::string varname)
+{
+	return IOThreadPool::Instance().Async([this, filename, varname]() { return LoadNPZ(filename, varname); });
+}
+
+std::future<LPCSTR> NpyArray::LoadNPZAsync(std::string filename, npz_t& arrays)
+{
+	npz_t* const pArrays = &arrays;
+	return IOThreadPool::Instance().Async([filename, pArrays]() { return LoadNPZ(filename, *pArrays); });
+}
+
+void NpyArray::LoadNPYAsync(std::string filename, callback_t callback)
+{
+	IOThreadPool::Instance().Async([this, filename]() { return LoadNPY(filename); }, callback);
+}
+
+void NpyArray::LoadNPZAsync(std::string filename, std::string varname, callback_t callback)
+{
+	IOThreadPool::Instance().Async([this, filename, varname]() { return LoadNPZ(filename, varname); }, callback);
+}
+
+void NpyArray::LoadNPZAsync(std::string filename, npz_t& arrays, callback_t callback)
+{
+	npz_t* const pArrays = &arrays;
+	IOThreadPool::Instance().Async([filename, pArrays]() { return LoadNPZ(filename, *pArrays); }, callback);
+}
+/*----------------------------------------------------------------*/
+
+
+
+// memory mapping
+LPCSTR NpyArray::MapNPY(std::string filename, bool bWritable)
+{
+	Release();
+	#ifdef _WIN32
+	return "error: memory mapping not supported";
+	#else
+	const int fd = open(filename.c_str(), bWritable ? O_RDWR : O_RDONLY);
+	if (fd < 0)
+		return "error: unable to open file";
+	const ScopeExitRun closeFd([&]() { close(fd); });
+	return MapNPY(fd, bWritable);
+	#endif
+}
+
+LPCSTR NpyArray::MapNPY(int fd, bool bWritable)
+{
+	#ifdef _WIN32
+	return "error: memory mapping not supported";
+	#else
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return "error: unable to stat file";
+	const size_t fileSize = (size_t)st.st_size;
+	if (fileSize < 16)
+		return "error: invalid header";
+	void* const ptr = mmap(NULL, fileSize, bWritable ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED)
+		return "error: unable to map file";
+	mapping = static_cast<uint8_t*>(ptr);
+	mappingSize = fileSize;
+	const size_t headerSize = SizeHeaderNPY(mapping);
+	// an array without values maps only the header
+	LPCSTR ret = headerSize > fileSize ? "error: invalid header" :
+		ParseHeaderNPY(mapping, shape, wordSize, type, fortranOrder);
+	if (ret == NULL) {
+		numValues = NumValue(shape);
+		if (headerSize + SizeBytes() > fileSize)
+			ret = "error: file too short";
+	}
+	if (ret != NULL) {
+		Release();
+		return ret;
+	}
+	data = mapping + headerSize;
+	return NULL;
+	#endif
+}
+
+LPCSTR NpyArray::CreateMappedNPY(std::string filename, const shape_t& _shape, size_t _wordSize, char _type)
+{
+	Release();
+	#ifdef _WIN32
+	return "error: memory mapping not supported";
+	#else
+	const std::vector<char> header = CreateHeaderNPY(_shape, std::abs(_type), _wordSize);
+	const size_t fileSize = header.size() + NumValue(_shape) * _wordSize;
+	const int fd = open(filename.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0666);
+	if (fd < 0)
+		return "error: unable to open file";
+	// remove the partially created file on failure
+	LPCSTR ret = NULL;
+	const ScopeExitRun closeFd([&]() {
+		close(fd);
+		if (ret != NULL)
+			unlink(filename.c_str());
+	});
+	if (pwrite(fd, header.data(), header.size(), 0) != (ssize_t)header.size())
+		return ret = "error: failed write";
+	// reserve the disk space upfront, so filling the mapping can not fail with SIGBUS;
+	// only if the file system does not support it, set the file size leaving the payload sparse
+	#ifdef __linux__
+	if (fallocate(fd, 0, 0, (off_t)fileSize) == 0)
+		return ret = MapNPY(fd, true);
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+		return ret = "error: unable to allocate file";
+	#endif
+	if (ftruncate(fd, (off_t)fileSize) != 0)
+		return ret = "error: unable to resize file";
+	return ret = MapNPY(fd, true);
+	#endif
+}
+
+LPCSTR NpyArray::Flush(bool bAsync) const
+{
+	if (!IsMapped())
+		return "error: array not mapped";
+	#ifndef _WIN32
+	if (msync(mapping, mappingSize, bAsync ? MS_ASYNC : MS_SYNC) != 0)
+		return "error: failed msync";
+	#endif
+	return NULL;
+}
+
+void NpyArray::Unmap()
+{
+	ASSERT(IsMapped());
+	#ifndef _WIN32
+	munmap(mapping, mappingSize);
+	#endif
+}
 /*----------------------------------------------------------------*/
 
 
 
 // output
-std::vector<char> NpyArray::CreateHeaderNPY(const shape_t& shape, char type, size_t wordSize)
+// Piece of the file content to be written at the given position
+struct WriteBuffer {
+	const void* data;
+	size_t size;
+	size_t offset;
+};
+typedef std::vector<WriteBuffer> WriteBuffers;
+
+#ifndef _WIN32
+// alignment and size of the bounce buffer used for O_DIRECT writes
+#define DIRECT_IO_ALIGN ((size_t)4096)
+#define DIRECT_IO_BUFFER ((size_t)16*1024*1024)
+
+// write the given contiguous buffers starting at the given position using vectored I/O
+static bool WriteVector(int fd, const WriteBuffer* buffers, size_t numBuffers, size_t skip, size_t offset)
+{
+	std::vector<iovec> iovs;
+	for (size_t i = 0; i < numBuffers; ++i) {
+		iovec iov;
+		iov.iov_base = const_cast<uint8_t*>(static_cast<const uint8_t*>(buffers[i].data) + skip);
+		iov.iov_len = buffers[i].size - skip;
+		skip = 0;
+		if (iov.iov_len > 0)
+			iovs.push_back(iov);
+	}
+	size_t idx = 0;
+	while (idx < iovs.size()) {
+		const ssize_t n = pwritev(fd, &iovs[idx], (int)std::min(iovs.size() - idx, size_t(IOV_MAX)), (off_t)offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		offset += (size_t)n;
+		// skip the written buffers and advance in the partially written one
+		for (size_t written = (size_t)n; written > 0; ) {
+			if (written >= iovs[idx].iov_len) {
+				written -= iovs[idx++].iov_len;
+			} else {
+				iovs[idx].iov_base = static_cast<uint8_t*>(iovs[idx].iov_base) + written;
+				iovs[idx].iov_len -= written;
+				written = 0;
+			}
+		}
+	}
+	return true;
+}
+
+// write the given memory block at the given position
+static bool WriteBlock(int fd, const uint8_t* data, size_t size, size_t offset)
+{
+	while (size > 0) {
+		const ssize_t n = pwrite(fd, data, size, (off_t)offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data += n;
+		size -= (size_t)n;
+		offset += (size_t)n;
+	}
+	return true;
+}
+
+// copy the next bytes of the given buffers in the memory block, advancing the buffer index and position
+static void GatherBuffers(const WriteBuffer* buffers, size_t& idx, size_t& skip, uint8_t* data, size_t size)
+{
+	while (size > 0) {
+		const size_t n = std::min(buffers[idx].size - skip, size);
+		memcpy(data, static_cast<const uint8_t*>(buffers[idx].data) + skip, n);
+		data += n;
+		size -= n;
+		if ((skip += n) == buffers[idx].size) {
+			++idx;
+			skip = 0;
+		}
+	}
+}
+
+// write the given contiguous buffers bypassing the page cache for their aligned bulk:
+// the unaligned head up to the first aligned position is written normally,
+// the bulk is copied through an aligned bounce buffer and written with O_DIRECT,
+// and the unaligned tail is written with vectored I/O;
+// falls back to vectored I/O if the file system does not allow direct I/O,
+// even if it refuses it only when writing
+static bool WriteDirect(int fd, const std::string& filename, const WriteBuffer* buffers, size_t numBuffers, size_t offset)
+{
+	size_t size = 0;
+	for (size_t i = 0; i < numBuffers; ++i)
+		size += buffers[i].size;
+	const size_t sizeHead = std::min((DIRECT_IO_ALIGN - offset % DIRECT_IO_ALIGN) % DIRECT_IO_ALIGN, size);
+	const size_t sizeAligned = (size - sizeHead) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+	#ifdef O_DIRECT
+	const int fdDirect = sizeAligned > 0 ? open(filename.c_str(), O_WRONLY|O_DIRECT) : -1;
+	#else
+	const int fdDirect = -1;
+	#endif
+	if (fdDirect < 0)
+		return WriteVector(fd, buffers, numBuffers, 0, offset);
+	const ScopeExitRun closeFd([&]() { close(fdDirect); });
+	const size_t sizeBuffer = std::min(sizeAligned, DIRECT_IO_BUFFER);
+	void* bounce;
+	if (posix_memalign(&bounce, DIRECT_IO_ALIGN, sizeBuffer) != 0)
+		return WriteVector(fd, buffers, numBuffers, 0, offset);
+	const ScopeExitRun freeBounce([&]() { free(bounce); });
+	uint8_t* const buffer = static_cast<uint8_t*>(bounce);
+	size_t idx = 0, skip = 0;
+	GatherBuffers(buffers, idx, skip, buffer, sizeHead);
+	if (!WriteBlock(fd, buffer, sizeHead, offset))
+		return false;
+	offset += sizeHead;
+	for (size_t written = 0; written < sizeAligned; ) {
+		const size_t sizeChunk = std::min(sizeAligned - written, sizeBuffer);
+		GatherBuffers(buffers, idx, skip, buffer, sizeChunk);
+		for (size_t done = 0; done < sizeChunk; ) {
+			const ssize_t n = pwrite(fdDirect, buffer + done, sizeChunk - done, (off_t)(offset + written + done));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && errno == EINVAL) {
+				// direct I/O refused (e.g. a larger alignment is required),
+				// write the rest of this chunk and everything after it normally
+				return WriteBlock(fd, buffer + done, sizeChunk - done, offset + written + done) &&
+					WriteVector(fd, buffers + idx, numBuffers - idx, skip, offset + written + sizeChunk);
+			}
+			if (n <= 0)
+				return false;
+			done += (size_t)n;
+		}
+		written += sizeChunk;
+	}
+	return WriteVector(fd, buffers + idx, numBuffers - idx, skip, offset + sizeAligned);
+}
+
+// make the renaming of a file inside the given folder durable
+static void SyncFolder(const std::string& folder)
+{
+	const int fd = open(folder.empty() ? "." : folder.c_str(), O_RDONLY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+// create and open a new file with a unique name in the folder of the given file;
+// it gets the permissions of the given file if it exists, else the ones
+// any new file gets under the current umask
+static int CreateTempFile(const std::string& filename, std::string& path)
+{
+	static thread_local std::mt19937 rnd(std::random_device{}());
+	for (int i = 0; i < 100; ++i) {
+		char suffix[16];
+		snprintf(suffix, sizeof(suffix), ".%08x", (unsigned)rnd());
+		path = filename + suffix;
+		const int fd = open(path.c_str(), O_WRONLY|O_CREAT|O_EXCL, 0666);
+		if (fd < 0) {
+			if (errno == EEXIST)
+				continue;
+			return -1;
+		}
+		struct stat st;
+		if (stat(filename.c_str(), &st) == 0)
+			fchmod(fd, st.st_mode & 07777);
+		return fd;
+	}
+	return -1;
+}
+
+// copy the content of the given file into the opened one
+static bool CopyFileContent(const std::string& filename, int fdDst)
+{
+	const int fdSrc = open(filename.c_str(), O_RDONLY);
+	if (fdSrc < 0)
+		return false;
+	const ScopeExitRun closeFd([&]() { close(fdSrc); });
+	struct stat st;
+	if (fstat(fdSrc, &st) != 0)
+		return false;
+	size_t offset = 0;
+	const size_t size = (size_t)st.st_size;
+	#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+	// let the kernel copy (or share) the data, if supported between these files
+	while (offset < size) {
+		const ssize_t n = copy_file_range(fdSrc, NULL, fdDst, NULL, size - offset, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		offset += (size_t)n;
+	}
+	#endif
+	std::vector<uint8_t> buffer(std::min(size - offset, DIRECT_IO_BUFFER));
+	while (offset < size) {
+		const ssize_t n = pread(fdSrc, buffer.data(), std::min(size - offset, buffer.size()), (off_t)offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		if (!WriteBlock(fdDst, buffer.data(), (size_t)n, offset))
+			return false;
+		offset += (size_t)n;
+	}
+	return true;
+}
+
+// durably replace the given file with the temporary one
+static bool CommitTempFile(const std::string& path, const std::string& filename)
+{
+	if (rename(path.c_str(), filename.c_str()) != 0) {
+		unlink(path.c_str());
+		return false;
+	}
+	SyncFolder(GetFolder(filename));
+	return true;
+}
+#else
+// durably replace the given file with the temporary one
+static bool CommitTempFile(const std::string& path, const std::string& filename)
+{
+	if (!MoveFileExA(path.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH)) {
+		remove(path.c_str());
+		return false;
+	}
+	return true;
+}
+#endif
+
+// write the buffers to the file applying the given policy flags;
+// if bAppend, the file exists and the buffers update it, in place
+// or, if atomic, in a copy of it that then replaces the original
+static LPCSTR WriteFile(const std::string& filename, const WriteBuffers& buffers, bool bAppend, unsigned flags)
+{
+	const bool bAtomic = (flags & NpyArray::WRITE_ATOMIC) != 0;
+	#ifdef _WIN32
+	if (bAtomic && bAppend)
+		return "error: atomic append not supported";
+	std::string path(filename);
+	if (bAtomic) {
+		path += ".XXXXXX";
+		if (_mktemp_s(&path[0], path.size()+1) != 0)
+			return "error: unable to create temporary file";
+	}
+	FILE* fp = fopen(path.c_str(), bAppend ? "r+b" : "wb");
+	if (!fp)
+		return "error: unable to open file";
+	ScopeExitRun closeFp([&]() {
+		fclose(fp);
+		if (bAtomic)
+			remove(path.c_str());
+	});
+	// when syncing, each run of contiguous buffers is made durable before writing the next one
+	const bool bSync = (flags & (NpyArray::WRITE_SYNC|NpyArray::WRITE_ATOMIC)) != 0;
+	for (size_t i = 0; i < buffers.size(); ++i) {
+		const WriteBuffer& buffer = buffers[i];
+		_fseeki64(fp, (__int64)buffer.offset, SEEK_SET);
+		if (fwrite(buffer.data, 1, buffer.size, fp) != buffer.size)
+			return "error: failed fwrite";
+		if (bSync && (i+1 == buffers.size() || buffers[i+1].offset != buffer.offset + buffer.size) &&
+			(fflush(fp) != 0 || _commit(_fileno(fp)) != 0))
+			return "error: failed fsync";
+	}
+	closeFp.Reset([]() {});
+	if (fclose(fp) != 0) {
+		if (bAtomic)
+			remove(path.c_str());
+		return "error: failed fwrite";
+	}
+	if (bAtomic && !CommitTempFile(path, filename))
+		return "error: unable to rename file";
+	return NULL;
+	#else
+	std::string path(filename);
+	int fd = bAtomic ?
+		CreateTempFile(filename, path) :
+		open(filename.c_str(), bAppend ? O_WRONLY : O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (fd < 0)
+		return "error: unable to open file";
+	ScopeExitRun closeFd([&]() {
+		close(fd);
+		if (bAtomic)
+			unlink(path.c_str());
+	});
+	if (bAtomic && bAppend && !CopyFileContent(filename, fd))
+		return "error: unable to copy file";
+	if (flags & NpyArray::WRITE_PREALLOCATE) {
+		size_t size = 0;
+		for (const WriteBuffer& buffer: buffers)
+			size = std::max(size, buffer.offset + buffer.size);
+		// best effort, not all file systems support it
+		#if defined(__linux__)
+		fallocate(fd, 0, 0, (off_t)size);
+		#elif defined(__APPLE__)
+		fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, (off_t)size, 0};
+		if (fcntl(fd, F_PREALLOCATE, &store) == -1) {
+			store.fst_flags = F_ALLOCATEALL;
+			fcntl(fd, F_PREALLOCATE, &store);
+		}
+		#elif defined(_POSIX_ADVISORY_INFO) && _POSIX_ADVISORY_INFO > 0
+		posix_fallocate(fd, 0, (off_t)size);
+		#endif
+	}
+	// write each run of contiguous buffers with one vectored call, in the given order;
+	// when syncing, each run is made durable before writing the next one,
+	// so an updated header never reaches the disk before the data it describes
+	const bool bSync = (flags & (NpyArray::WRITE_SYNC|NpyArray::WRITE_ATOMIC)) != 0;
+	for (size_t i = 0; i < buffers.size(); ) {
+		size_t j = i + 1;
+		while (j < buffers.size() && buffers[j].offset == buffers[j-1].offset + buffers[j-1].size)
+			++j;
+		const bool bWritten = (flags & NpyArray::WRITE_DIRECT) ?
+			WriteDirect(fd, path, &buffers[i], j - i, buffers[i].offset) :
+			WriteVector(fd, &buffers[i], j - i, 0, buffers[i].offset);
+		if (!bWritten)
+			return "error: failed write";
+		if (bSync && fsync(fd) != 0)
+			return "error: failed fsync";
+		i = j;
+	}
+	closeFd.Reset([]() {});
+	if (close(fd) != 0) {
+		if (bAtomic)
+			unlink(path.c_str());
+		return "error: failed write";
+	}
+	if (bAtomic && !CommitTempFile(path, filename))
+		return "error: unable to rename file";
+	// a new file is durable only once its folder entry is
+	if ((flags & NpyArray::WRITE_SYNC) && !bAtomic && !bAppend)
+		SyncFolder(GetFolder(filename));
+	return NULL;
+	#endif
+}
+
+std::vector<char> NpyArray::CreateHeaderNPY(const shape_t& shape, char type, size_t wordSize, size_t minSize)
 {
 	std::vector<char> dict;
 	add(dict, "{'descr': '");
@@ -292,6 +920,10 @@ std::vector<char> NpyArray::CreateHeaderNPY(const shape_t& shape, char type, siz
 		add(dict, std::to_string(shape[i]));
 	}
 	add(dict, "), }");
+	// reserve room for the first axis to grow, so appending can rewrite the header in place;
+	// not needed if the header has to fill a given size, as when rewriting an existing one
+	if (minSize == 0)
+		dict.insert(dict.end(), GROWTH_AXIS_MAX_DIGITS - std::min(std::to_string(shape[0]).size(), GROWTH_AXIS_MAX_DIGITS), ' ');
 	// pad with spaces so that preamble+dict is modulo 16 bytes
 	// preamble is 10/12 bytes and dict needs to end with \n
 	char ver = 1;
@@ -300,6 +932,10 @@ std::vector<char> NpyArray::CreateHeaderNPY(const shape_t& shape, char type, siz
 		ver = 2;
 		remainder = 16 - (12 + dict.size()) % 16;
 	}
+	// pad more if requested, so the header can be rewritten later with a longer shape
+	const size_t size = (ver == 1 ? 10 : 12) + dict.size() + remainder;
+	if (size < minSize)
+		remainder += minSize - size;
 	dict.insert(dict.end(), remainder, ' ');
 	dict.back() = '\n';
 
@@ -316,13 +952,15 @@ std::vector<char> NpyArray::CreateHeaderNPY(const shape_t& shape, char type, siz
 	return header;
 }
 
-LPCSTR NpyArray::SaveNPY(std::string filename, bool bAppend) const
+LPCSTR NpyArray::SaveNPY(std::string filename, bool bAppend, unsigned flags) const
 {
 	FILE* fp;
 	shape_t _shape;
 	const shape_t* pShape;
-	if (bAppend && (fp=fopen(filename.c_str(), "r+b")) != NULL) {
+	size_t headerSize = 0, fileSize = 0;
+	if (bAppend && (fp=fopen(filename.c_str(), "rb")) != NULL) {
 		// file exists, append to it; read the header, modify the array size
+		const ScopeExitRun closeFp([&]() { fclose(fp); });
 		char _type;
 		size_t _wordSize;
 		bool _fortranOrder;
@@ -342,36 +980,47 @@ LPCSTR NpyArray::SaveNPY(std::string filename, bool bAppend) const
 		}
 		_shape[0] += shape[0];
 		pShape = &_shape;
+		headerSize = (size_t)ftell(fp);
+		fseek(fp, 0, SEEK_END);
+		fileSize = (size_t)ftell(fp);
 	} else {
 		// create a new file
-		fp = fopen(filename.c_str(), "wb");
 		pShape = &shape;
+		bAppend = false;
 	}
-	if (!fp)
-		return "error: unable to open file";
 
-	const std::vector<char> header = CreateHeaderNPY(*pShape, std::abs(type), wordSize);
+	// the header is updated in place, so it must keep the size of the existing one
+	const std::vector<char> header = CreateHeaderNPY(*pShape, std::abs(type), wordSize, headerSize);
+	if (bAppend && header.size() != headerSize)
+		return "error: npy_save header does not fit the existing one";
+	if (!bAppend)
+		fileSize = header.size();
 
-	fseek(fp, 0, SEEK_SET);
-	fwrite(header.data(), sizeof(char), header.size(), fp);
-	fseek(fp, 0, SEEK_END);
-	fwrite(Data(), wordSize, numValues, fp);
-	fclose(fp);
-	return NULL;
+	WriteBuffers buffers;
+	if (bAppend) {
+		// write the new data before updating the header that describes it
+		buffers.push_back(WriteBuffer{Data(), SizeBytes(), fileSize});
+		buffers.push_back(WriteBuffer{header.data(), header.size(), 0});
+	} else {
+		buffers.push_back(WriteBuffer{header.data(), header.size(), 0});
+		buffers.push_back(WriteBuffer{Data(), SizeBytes(), fileSize});
+	}
+	return WriteFile(filename, buffers, bAppend, flags);
 }
 
-LPCSTR NpyArray::SaveNPZ(std::string zipname, std::string varname, bool bAppend) const
+LPCSTR NpyArray::SaveNPZ(std::string zipname, std::string varname, bool bAppend, unsigned flags) const
 {
 	FILE* fp;
 	uint16_t nrecs = 0;
 	size_t globalHeaderOffset = 0;
 	std::vector<char> globalHeader;
-	if (bAppend && (fp=fopen(zipname.c_str(), "r+b")) != NULL) {
+	if (bAppend && (fp=fopen(zipname.c_str(), "rb")) != NULL) {
 		// zip file exists, add a new NPY array to it;
 		// first read the footer and parse the offset and size of the global header
 		// then read and store the global header;
 		// the new data will be written at the start of the global header,
 		// then append the global header and footer below it
+		const ScopeExitRun closeFp([&]() { fclose(fp); });
 		size_t globalHeaderSize;
 		LPCSTR ret = ParseFooterZIP(fp, nrecs, globalHeaderSize, globalHeaderOffset);
 		if (ret != NULL)
@@ -381,12 +1030,9 @@ LPCSTR NpyArray::SaveNPZ(std::string zipname, std::string varname, bool bAppend)
 		size_t res = fread(globalHeader.data(), sizeof(char), globalHeaderSize, fp);
 		if (res != globalHeaderSize)
 			return "error: header read error while adding to existing zip";
-		fseek(fp, (long)globalHeaderOffset, SEEK_SET);
 	} else {
-		fp = fopen(zipname.c_str(), "wb");
+		bAppend = false;
 	}
-	if (!fp)
-		return "error: unable to open file";
 
 	const std::vector<char> npyHeader = CreateHeaderNPY(shape, std::abs(type), wordSize);
 	const size_t nbytes = SizeBytes() + npyHeader.size();
@@ -439,13 +1085,14 @@ LPCSTR NpyArray::SaveNPZ(std::string zipname, std::string varname, bool bAppend)
 	add(footer, (uint16_t)0); // zip file comment length
 
 	// write everything
-	fwrite(localHeader.data(), sizeof(char), localHeader.size(), fp);
-	fwrite(npyHeader.data(), sizeof(char), npyHeader.size(), fp);
-	fwrite(Data(), wordSize, numValues, fp);
-	fwrite(globalHeader.data(), sizeof(char), globalHeader.size(), fp);
-	fwrite(footer.data(), sizeof(char), footer.size(), fp);
-	fclose(fp);
-	return NULL;
+	WriteBuffers buffers;
+	size_t offset = globalHeaderOffset;
+	buffers.push_back(WriteBuffer{localHeader.data(), localHeader.size(), offset});
+	buffers.push_back(WriteBuffer{npyHeader.data(), npyHeader.size(), offset += localHeader.size()});
+	buffers.push_back(WriteBuffer{Data(), SizeBytes(), offset += npyHeader.size()});
+	buffers.push_back(WriteBuffer{globalHeader.data(), globalHeader.size(), offset += SizeBytes()});
+	buffers.push_back(WriteBuffer{footer.data(), footer.size(), offset += globalHeader.size()});
+	return WriteFile(zipname, buffers, bAppend, flags);
 }
 /*----------------------------------------------------------------*/
 
@@ -511,3 +1158,806 @@ const std::type_info& NpyArray::getTypeInfo(char t, size_t s)
 	return typeid(void);
 }
 /*----------------------------------------------------------------*/
+
+
+
+// batch loader
+NpyBatchLoader::NpyBatchLoader(items_t _items, size_t _batchSize, size_t _numPrefetch, bool _bShuffle, unsigned _seed)
+	: items(std::move(_items)), batchSize(std::max(_batchSize, size_t(1))), numPrefetch(std::max(_numPrefetch, size_t(1))),
+	bShuffle(_bShuffle), seed(_seed), epoch(0), nextItem(0), wordSize(0), type(0)
+{
+	Shuffle();
+}
+
+NpyBatchLoader::~NpyBatchLoader()
+{
+	Wait();
+}
+
+LPCSTR NpyBatchLoader::Next(NpyArray& batch)
+{
+	if (wordSize == 0) {
+		const LPCSTR ret = Init();
+		if (ret != NULL)
+			return ret;
+	}
+	Schedule();
+	if (batches.empty()) {
+		batch.Release();
+		return NULL;
+	}
+	Batch& front = *batches.front();
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		cv.wait(lock, [&front]() { return front.numPending == 0; });
+	}
+	const LPCSTR ret = front.ret;
+	batch = std::move(front.arr);
+	batches.pop_front();
+	Schedule();
+	return ret;
+}
+
+void NpyBatchLoader::Reset()
+{
+	Wait();
+	batches.clear();
+	++epoch;
+	Shuffle();
+}
+
+// open and index the NPZ files, and read the shape and type of the first item,
+// all others are expected to match it
+LPCSTR NpyBatchLoader::Init()
+{
+	if (items.empty())
+		return NULL;
+	for (const Item& item: items) {
+		if (item.varname.empty() || archives.find(item.filename) != archives.end())
+			continue;
+		std::unique_ptr<NpyReader> reader(new NpyReader);
+		const LPCSTR ret = reader->Open(item.filename);
+		if (ret != NULL)
+			return ret;
+		archives.emplace(item.filename, std::move(reader));
+	}
+	NpyReader file;
+	const NpyReader* pReader;
+	NpyReader::Entry entry;
+	LPCSTR ret = OpenItem(items[order.front()], file, pReader, entry);
+	if (ret != NULL)
+		return ret;
+	NpyArray::shape_t _shape;
+	size_t _wordSize, headerSize;
+	char _type;
+	bool _fortranOrder;
+	ret = ReadHeader(*pReader, entry, _shape, _wordSize, _type, _fortranOrder, headerSize);
+	if (ret != NULL)
+		return ret;
+	if (_fortranOrder)
+		return "error: batch items must be in row-major order";
+	sampleShape = _shape;
+	type = _type;
+	wordSize = _wordSize;
+	return NULL;
+}
+
+void NpyBatchLoader::Shuffle()
+{
+	order.resize(items.size());
+	std::iota(order.begin(), order.end(), size_t(0));
+	if (bShuffle)
+		std::shuffle(order.begin(), order.end(), std::mt19937(seed + epoch));
+	nextItem = 0;
+}
+
+// queue the loading of the next batches till the prefetch window is full
+void NpyBatchLoader::Schedule()
+{
+	if (wordSize == 0)
+		return;
+	const size_t sampleBytes = NpyArray::NumValue(sampleShape) * wordSize;
+	while (batches.size() < numPrefetch && nextItem < order.size()) {
+		const size_t numItems = std::min(batchSize, order.size() - nextItem);
+		NpyArray::shape_t shape(1, numItems);
+		shape.insert(shape.end(), sampleShape.cbegin(), sampleShape.cend());
+		std::unique_ptr<Batch> batch(new Batch{NpyArray(shape, wordSize, type), numItems, NULL});
+		batch->arr.Allocate();
+		Batch* const pBatch = batch.get();
+		batches.emplace_back(std::move(batch));
+		for (size_t i = 0; i < numItems; ++i) {
+			const Item* const pItem = &items[order[nextItem++]];
+			uint8_t* const dst = pBatch->arr.Data() + i * sampleBytes;
+			IOThreadPool::Instance().Enqueue([this, pBatch, pItem, dst]() {
+				const LPCSTR ret = LoadItem(*pItem, dst);
+				std::lock_guard<std::mutex> lock(mtx);
+				if (ret != NULL && pBatch->ret == NULL)
+					pBatch->ret = ret;
+				if (--pBatch->numPending == 0)
+					cv.notify_all();
+			});
+		}
+	}
+}
+
+// wait for all scheduled batches to finish loading
+void NpyBatchLoader::Wait()
+{
+	std::unique_lock<std::mutex> lock(mtx);
+	cv.wait(lock, [this]() {
+		for (const std::unique_ptr<Batch>& batch: batches)
+			if (batch->numPending != 0)
+				return false;
+		return true;
+	});
+}
+
+// locate the item data: NPY files are opened on their own,
+// NPZ members are looked up in the archives indexed by Init()
+LPCSTR NpyBatchLoader::OpenItem(const Item& item, NpyReader& file, const NpyReader*& pReader, NpyReader::Entry& entry) const
+{
+	if (item.varname.empty()) {
+		const LPCSTR ret = file.Open(item.filename);
+		if (ret != NULL)
+			return ret;
+		if (file.IsNPZ())
+			return "error: not a NPY file";
+		entry.offset = 0;
+		entry.comprBytes = entry.uncomprBytes = file.fileSize;
+		entry.comprMethod = 0;
+		pReader = &file;
+		return NULL;
+	}
+	const auto itArchive = archives.find(item.filename);
+	if (itArchive == archives.cend())
+		return "error: unable to open file";
+	pReader = itArchive->second.get();
+	const NpyReader::entries_t::const_iterator itEntry = pReader->Entries().find(item.varname);
+	if (itEntry == pReader->Entries().cend())
+		return "error: variable name not found";
+	entry = itEntry->second;
+	return NULL;
+}
+
+// read and parse only the NPY header of the given array;
+// for compressed arrays only the beginning of the stream is inflated
+LPCSTR NpyBatchLoader::ReadHeader(const NpyReader& reader, const NpyReader::Entry& entry, NpyArray::shape_t& shape, size_t& wordSize, char& type, bool& fortranOrder, size_t& headerSize)
+{
+	std::vector<uint8_t> header(12);
+	if (entry.comprMethod == 0) {
+		if (entry.comprBytes < header.size() || !reader.Read(header.data(), header.size(), entry.offset))
+			return "error: invalid header";
+		headerSize = NpyArray::SizeHeaderNPY(header.data());
+		header.resize(headerSize);
+		if (headerSize > entry.comprBytes || !reader.Read(header.data(), headerSize, entry.offset))
+			return "error: invalid header";
+		return NpyArray::ParseHeaderNPY(header.data(), shape, wordSize, type, fortranOrder);
+	}
+
+	z_stream d_stream;
+	d_stream.zalloc = Z_NULL;
+	d_stream.zfree = Z_NULL;
+	d_stream.opaque = Z_NULL;
+	d_stream.avail_in = 0;
+	d_stream.next_in = Z_NULL;
+	if (inflateInit2(&d_stream, -MAX_WBITS) != Z_OK)
+		return "error: can not init inflate";
+	const ScopeExitRun endInflate([&]() { inflateEnd(&d_stream); });
+
+	// inflate the preamble first, then the rest of the header once its size is known
+	uint8_t bufferCompr[4096];
+	size_t offset = 0;
+	headerSize = 0;
+	d_stream.avail_out = (uInt)header.size();
+	d_stream.next_out = header.data();
+	while (true) {
+		if (d_stream.avail_in == 0) {
+			const size_t size = std::min(sizeof(bufferCompr), entry.comprBytes - offset);
+			if (size == 0 || !reader.Read(bufferCompr, size, entry.offset + offset))
+				return "error: invalid header";
+			offset += size;
+			d_stream.avail_in = (uInt)size;
+			d_stream.next_in = bufferCompr;
+		}
+		const int err = inflate(&d_stream, Z_SYNC_FLUSH);
+		if (err != Z_OK && err != Z_STREAM_END)
+			return "error: can not uncompress";
+		if (d_stream.avail_out == 0) {
+			if (headerSize != 0)
+				break;
+			headerSize = NpyArray::SizeHeaderNPY(header.data());
+			if (headerSize <= header.size() || headerSize > entry.uncomprBytes)
+				return "error: invalid header";
+			header.resize(headerSize);
+			d_stream.avail_out = (uInt)(headerSize - 12);
+			d_stream.next_out = header.data() + 12;
+		} else
+		if (err == Z_STREAM_END) {
+			return "error: invalid header";
+		}
+	}
+	return NpyArray::ParseHeaderNPY(header.data(), shape, wordSize, type, fortranOrder);
+}
+
+// read the item data directly at the given address in the batch
+LPCSTR NpyBatchLoader::LoadItem(const Item& item, uint8_t* dst) const
+{
+	NpyReader file;
+	const NpyReader* pReader;
+	NpyReader::Entry entry;
+	LPCSTR ret = OpenItem(item, file, pReader, entry);
+	if (ret != NULL)
+		return ret;
+	const size_t sizeBytes = NpyArray::NumValue(sampleShape) * wordSize;
+	NpyArray::shape_t _shape;
+	size_t _wordSize;
+	char _type;
+	bool _fortranOrder;
+	if (entry.comprMethod == 0) {
+		size_t headerSize;
+		ret = ReadHeader(*pReader, entry, _shape, _wordSize, _type, _fortranOrder, headerSize);
+		if (ret != NULL)
+			return ret;
+		if (_shape != sampleShape || _wordSize != wordSize || _type != type || _fortranOrder)
+			return "error: batch item shape or type mismatch";
+		if (headerSize + sizeBytes > entry.comprBytes || !pReader->Read(dst, sizeBytes, entry.offset + headerSize))
+			return "error: failed read";
+		return NULL;
+	}
+
+	// compressed array: inflate the NPY header apart and the data in place;
+	// the scratch buffers are reused by all the loads run on this thread
+	if (entry.uncomprBytes < sizeBytes + 16)
+		return "error: batch item shape or type mismatch";
+	static thread_local std::vector<uint8_t> bufferCompr;
+	static thread_local std::vector<uint8_t> header;
+	bufferCompr.resize(entry.comprBytes);
+	header.resize(entry.uncomprBytes - sizeBytes);
+	if (!pReader->Read(bufferCompr.data(), entry.comprBytes, entry.offset))
+		return "error: failed read";
+
+	z_stream d_stream;
+	d_stream.zalloc = Z_NULL;
+	d_stream.zfree = Z_NULL;
+	d_stream.opaque = Z_NULL;
+	d_stream.avail_in = 0;
+	d_stream.next_in = Z_NULL;
+	if (inflateInit2(&d_stream, -MAX_WBITS) != Z_OK)
+		return "error: can not init inflate";
+	const ScopeExitRun endInflate([&]() { inflateEnd(&d_stream); });
+
+	d_stream.avail_in = (uInt)entry.comprBytes;
+	d_stream.next_in = bufferCompr.data();
+	d_stream.avail_out = (uInt)header.size();
+	d_stream.next_out = header.data();
+	int err = inflate(&d_stream, Z_SYNC_FLUSH);
+	if ((err != Z_OK && err != Z_STREAM_END) || d_stream.avail_out != 0)
+		return "error: can not uncompress";
+
+	// make sure the NPY header fills exactly the space left before the data
+	if (NpyArray::SizeHeaderNPY(header.data()) != header.size())
+		return "error: batch item shape or type mismatch";
+	ret = NpyArray::ParseHeaderNPY(header.data(), _shape, _wordSize, _type, _fortranOrder);
+	if (ret != NULL)
+		return ret;
+	if (_shape != sampleShape || _wordSize != wordSize || _type != type || _fortranOrder)
+		return "error: batch item shape or type mismatch";
+
+	d_stream.avail_out = (uInt)sizeBytes;
+	d_stream.next_out = dst;
+	err = inflate(&d_stream, Z_FINISH);
+	if (err != Z_STREAM_END || d_stream.total_out != entry.uncomprBytes)
+		return "error: can not uncompress";
+	return NULL;
+}
+/*----------------------------------------------------------------*/
+
+
+
+// reader
+LPCSTR NpyReader::Open(std::string filename)
+{
+	Close();
+	#ifdef _WIN32
+	const HANDLE hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return "error: unable to open file";
+	fd = (intptr_t)hFile;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(hFile, &size)) {
+		Close();
+		return "error: unable to stat file";
+	}
+	fileSize = (size_t)size.QuadPart;
+	#else
+	fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return "error: unable to open file";
+	struct stat st;
+	if (fstat((int)fd, &st) != 0) {
+		Close();
+		return "error: unable to stat file";
+	}
+	fileSize = (size_t)st.st_size;
+	#endif
+	char id[4];
+	if (!Read(id, 4, 0)) {
+		Close();
+		return "error: invalid header id";
+	}
+	bNPZ = (id[0] == 'P' && id[1] == 'K' && id[2] == 0x03 && id[3] == 0x04);
+	if (bNPZ) {
+		const LPCSTR ret = ParseDirectoryZIP();
+		if (ret != NULL) {
+			Close();
+			return ret;
+		}
+	}
+	return NULL;
+}
+
+void NpyReader::Close()
+{
+	if (fd != -1) {
+		#ifdef _WIN32
+		CloseHandle((HANDLE)fd);
+		#else
+		close((int)fd);
+		#endif
+	}
+	fd = -1;
+	fileSize = 0;
+	bNPZ = false;
+	entries.clear();
+}
+
+LPCSTR NpyReader::LoadNPY(NpyArray& arr) const
+{
+	if (!IsOpen())
+		return "error: file not open";
+	if (bNPZ)
+		return "error: not a NPY file";
+	const Entry entry = {0, fileSize, fileSize, 0};
+	return LoadArray(entry, arr);
+}
+
+LPCSTR NpyReader::LoadNPZ(const std::string& varname, NpyArray& arr) const
+{
+	const entries_t::const_iterator it = entries.find(varname);
+	if (it == entries.cend())
+		return "error: variable name not found";
+	return LoadArray(it->second, arr);
+}
+
+LPCSTR NpyReader::LoadNPZ(NpyArray::npz_t& arrays) const
+{
+	for (const entries_t::value_type& entry: entries) {
+		NpyArray arr;
+		const LPCSTR ret = LoadArray(entry.second, arr);
+		if (ret != NULL)
+			return ret;
+		arrays.emplace(entry.first, std::move(arr));
+	}
+	return NULL;
+}
+
+// index the arrays listed in the central directory of the NPZ file
+LPCSTR NpyReader::ParseDirectoryZIP()
+{
+	char footer[32];
+	if (fileSize < 22 || !Read(footer, 22, fileSize - 22))
+		return "error: failed footer";
+	uint16_t nrecs;
+	size_t globalHeaderSize, globalHeaderOffset;
+	const LPCSTR ret = NpyArray::ParseFooterZIP(footer, nrecs, globalHeaderSize, globalHeaderOffset);
+	if (ret != NULL)
+		return ret;
+	std::vector<char> globalHeader(globalHeaderSize);
+	if (globalHeaderOffset + globalHeaderSize > fileSize || !Read(globalHeader.data(), globalHeaderSize, globalHeaderOffset))
+		return "error: failed to read global header";
+	size_t pos = 0;
+	for (uint16_t r = 0; r < nrecs; ++r) {
+		const char* const record = globalHeader.data() + pos;
+		if (pos + 46 > globalHeaderSize || record[0] != 'P' || record[1] != 'K' || record[2] != 0x01 || record[3] != 0x02)
+			return "error: invalid global header";
+		Entry entry;
+		entry.comprMethod = *reinterpret_cast<const uint16_t*>(record+10);
+		entry.comprBytes = *reinterpret_cast<const uint32_t*>(record+20);
+		entry.uncomprBytes = *reinterpret_cast<const uint32_t*>(record+24);
+		const uint16_t lenName = *reinterpret_cast<const uint16_t*>(record+28);
+		const uint16_t lenExtraField = *reinterpret_cast<const uint16_t*>(record+30);
+		const uint16_t lenComment = *reinterpret_cast<const uint16_t*>(record+32);
+		const uint32_t localHeaderOffset = *reinterpret_cast<const uint32_t*>(record+42);
+		if (pos + 46 + lenName > globalHeaderSize)
+			return "error: invalid global header";
+		std::string varname(record+46, lenName);
+		pos += 46 + lenName + lenExtraField + lenComment;
+
+		// erase the lagging .npy
+		if (varname.size() >= 4 && varname.compare(varname.size()-4, 4, ".npy") == 0)
+			varname.erase(varname.end()-4, varname.end());
+
+		// the local extra field can differ from the one in the global header
+		char localHeader[32];
+		if (!Read(localHeader, 30, localHeaderOffset) || localHeader[2] != 0x03 || localHeader[3] != 0x04)
+			return "error: invalid local header";
+		entry.offset = localHeaderOffset + 30 +
+			*reinterpret_cast<const uint16_t*>(localHeader+26) +
+			*reinterpret_cast<const uint16_t*>(localHeader+28);
+		entries.emplace(std::move(varname), entry);
+	}
+	return NULL;
+}
+
+LPCSTR NpyReader::LoadArray(const Entry& entry, NpyArray& arr) const
+{
+	arr.Release();
+	if (entry.offset + entry.comprBytes > fileSize)
+		return "error: array exceeds the file size";
+	if (entry.comprMethod != 0) {
+		std::vector<uint8_t> bufferCompr(entry.comprBytes);
+		if (!Read(bufferCompr.data(), entry.comprBytes, entry.offset))
+			return "error: failed read";
+		return arr.InflateNPZ(bufferCompr.data(), (uint32_t)entry.comprBytes, (uint32_t)entry.uncomprBytes);
+	}
+	uint8_t preamble[12];
+	if (entry.comprBytes < sizeof(preamble) || !Read(preamble, sizeof(preamble), entry.offset))
+		return "error: invalid header";
+	const size_t headerSize = NpyArray::SizeHeaderNPY(preamble);
+	if (headerSize > entry.comprBytes)
+		return "error: invalid header";
+	std::vector<uint8_t> header(headerSize);
+	if (!Read(header.data(), headerSize, entry.offset))
+		return "error: invalid header";
+	const LPCSTR ret = NpyArray::ParseHeaderNPY(header.data(), arr.shape, arr.wordSize, arr.type, arr.fortranOrder);
+	if (ret != NULL)
+		return ret;
+	arr.numValues = NpyArray::NumValue(arr.shape);
+	if (headerSize + arr.SizeBytes() > entry.comprBytes)
+		return "error: array exceeds the file size";
+	arr.init();
+	if (!Read(arr.Data(), arr.SizeBytes(), entry.offset + headerSize))
+		return "error: failed read";
+	return NULL;
+}
+
+// read the given number of bytes at the given file position,
+// without relying on the file offset shared by all threads
+bool NpyReader::Read(void* buffer, size_t size, size_t offset) const
+{
+	uint8_t* p = static_cast<uint8_t*>(buffer);
+	while (size > 0) {
+		#ifdef _WIN32
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = (DWORD)((uint64_t)offset & 0xFFFFFFFF);
+		overlapped.OffsetHigh = (DWORD)((uint64_t)offset >> 32);
+		DWORD n;
+		if (!ReadFile((HANDLE)fd, p, (DWORD)std::min(size, (size_t)(1u << 30)), &n, &overlapped) || n == 0)
+			return false;
+		#else
+		const ssize_t n = pread((int)fd, p, size, (off_t)offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		#endif
+		p += n;
+		size -= (size_t)n;
+		offset += (size_t)n;
+	}
+	return true;
+}
+/*----------------------------------------------------------------*/
+
+
+
+// shards
+size_t NpyShardManifest::NumRows() const
+{
+	size_t numRows = 0;
+	for (const Shard& shard: shards)
+		numRows += shard.numRows;
+	return numRows;
+}
+
+LPCSTR NpyShardManifest::Load(std::string filename)
+{
+	std::ifstream in(filename.c_str());
+	if (!in)
+		return "error: unable to open file";
+	std::string line;
+	if (!std::getline(in, line) || line != "TinyNPY shards 1")
+		return "error: invalid manifest";
+	shards.clear();
+	rowShape.clear();
+	wordSize = 0;
+	type = 0;
+	while (std::getline(in, line)) {
+		std::istringstream ss(line);
+		std::string key;
+		ss >> key;
+		if (key == "type") {
+			if (!(ss >> type >> wordSize))
+				return "error: invalid manifest type";
+		} else
+		if (key == "shape") {
+			size_t size;
+			while (ss >> size)
+				rowShape.push_back(size);
+		} else
+		if (key == "shard") {
+			Shard shard;
+			if (!(ss >> shard.numRows >> std::ws) || !std::getline(ss, shard.filename) || shard.filename.empty())
+				return "error: invalid manifest shard";
+			shards.emplace_back(std::move(shard));
+		} else
+		if (!key.empty()) {
+			return "error: invalid manifest";
+		}
+	}
+	// the type is known only once the first rows were written
+	if (wordSize == 0 && !shards.empty())
+		return "error: invalid manifest type";
+	return NULL;
+}
+
+// the manifest is written to a temporary file renamed over the previous one,
+// so a crash while saving never loses the index of the existing shards
+LPCSTR NpyShardManifest::Save(std::string filename) const
+{
+	#ifdef _WIN32
+	std::string path(filename + ".XXXXXX");
+	FILE* fp = _mktemp_s(&path[0], path.size()+1) == 0 ? fopen(path.c_str(), "w") : NULL;
+	#else
+	std::string path;
+	const int fd = CreateTempFile(filename, path);
+	FILE* fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (fd >= 0 && !fp)
+		close(fd);
+	#endif
+	if (!fp)
+		return "error: unable to open file";
+	ScopeExitRun closeFp([&]() {
+		fclose(fp);
+		remove(path.c_str());
+	});
+	fprintf(fp, "TinyNPY shards 1\n");
+	if (wordSize > 0) {
+		fprintf(fp, "type %c %zu\n", type, wordSize);
+		fprintf(fp, "shape");
+		for (size_t size: rowShape)
+			fprintf(fp, " %zu", size);
+		fprintf(fp, "\n");
+	}
+	for (const Shard& shard: shards)
+		fprintf(fp, "shard %zu %s\n", shard.numRows, shard.filename.c_str());
+	if (fflush(fp) != 0 || ferror(fp))
+		return "error: failed fwrite";
+	#ifdef _WIN32
+	if (_commit(_fileno(fp)) != 0)
+	#else
+	if (fsync(fileno(fp)) != 0)
+	#endif
+		return "error: failed fsync";
+	closeFp.Reset([]() {});
+	if (fclose(fp) != 0) {
+		remove(path.c_str());
+		return "error: failed fwrite";
+	}
+	if (!CommitTempFile(path, filename))
+		return "error: unable to rename file";
+	return NULL;
+}
+
+
+LPCSTR NpyShardWriter::Open(std::string _manifestName, size_t _maxShardBytes, bool bAppend)
+{
+	LPCSTR ret = Close();
+	if (ret != NULL)
+		return ret;
+	manifest = NpyShardManifest();
+	if (bAppend && std::ifstream(_manifestName.c_str()).good()) {
+		// manifest exists, the new rows go to new shards
+		ret = manifest.Load(_manifestName);
+		if (ret != NULL)
+			return ret;
+	}
+	manifestName = _manifestName;
+	maxShardBytes = _maxShardBytes;
+	return manifest.Save(manifestName);
+}
+
+LPCSTR NpyShardWriter::Append(const NpyArray& rows)
+{
+	if (manifestName.empty())
+		return "error: writer not open";
+	if (bFailed)
+		return "error: writer failed, close it and append in a new shard";
+	if (rows.IsEmpty() || rows.Shape().empty())
+		return "error: no rows to append";
+	if (rows.ColMajor())
+		return "error: rows must be in row-major order";
+	const NpyArray::shape_t rowShape(rows.Shape().cbegin()+1, rows.Shape().cend());
+	if (manifest.wordSize == 0) {
+		manifest.rowShape = rowShape;
+		manifest.wordSize = rows.SizeValueBytes();
+		manifest.type = std::abs(rows.Type());
+	} else {
+		if (manifest.wordSize != rows.SizeValueBytes() || manifest.type != std::abs(rows.Type()))
+			return "error: attempting to append data of different type";
+		if (manifest.rowShape != rowShape)
+			return "error: attempting to append misshaped data";
+	}
+	const size_t rowBytes = manifest.SizeRowBytes();
+	const size_t maxRows = rowBytes > 0 ? std::max(maxShardBytes / rowBytes, size_t(1)) : rows.Shape()[0];
+	const uint8_t* data = rows.Data();
+	size_t numRows = rows.Shape()[0];
+	while (numRows > 0) {
+		if (fp == NULL) {
+			const LPCSTR ret = OpenShard();
+			if (ret != NULL)
+				return ret;
+		}
+		NpyShardManifest::Shard& shard = manifest.shards.back();
+		const size_t n = std::min(numRows, maxRows - std::min(shard.numRows, maxRows));
+		if (fwrite(data, 1, n * rowBytes, fp) != n * rowBytes) {
+			// the shard may end with a partial row now, refuse any further rows
+			// and let CloseShard() keep only the complete ones
+			bFailed = true;
+			return "error: failed fwrite";
+		}
+		shard.numRows += n;
+		data += n * rowBytes;
+		numRows -= n;
+		if (shard.numRows >= maxRows) {
+			const LPCSTR ret = CloseShard();
+			if (ret != NULL)
+				return ret;
+		}
+	}
+	return NULL;
+}
+
+LPCSTR NpyShardWriter::Close()
+{
+	if (manifestName.empty())
+		return NULL;
+	const LPCSTR ret = CloseShard();
+	manifestName.clear();
+	return ret;
+}
+
+LPCSTR NpyShardWriter::OpenShard()
+{
+	ASSERT(fp == NULL);
+	// name the shards after the full manifest name, so manifests
+	// differing only in their extension do not share shard files
+	char index[16];
+	snprintf(index, sizeof(index), ".%05u.npy", (unsigned)manifest.shards.size());
+	const std::string filename(manifestName + index);
+	fp = fopen(filename.c_str(), "wb");
+	if (!fp)
+		return "error: unable to open file";
+	// the header reserves room for the row count to grow,
+	// so it can be updated in place when the shard is completed
+	NpyArray::shape_t shape(1, 0);
+	shape.insert(shape.end(), manifest.rowShape.cbegin(), manifest.rowShape.cend());
+	const std::vector<char> header = NpyArray::CreateHeaderNPY(shape, manifest.type, manifest.wordSize);
+	headerSize = header.size();
+	if (fwrite(header.data(), sizeof(char), header.size(), fp) != header.size())
+		return "error: failed fwrite";
+	NpyShardManifest::Shard shard;
+	shard.filename = filename.substr(GetFolder(manifestName).size());
+	shard.numRows = 0;
+	manifest.shards.emplace_back(std::move(shard));
+	return NULL;
+}
+
+// write the final header of the current shard and
+// update the manifest to include it
+LPCSTR NpyShardWriter::CloseShard()
+{
+	if (fp == NULL)
+		return NULL;
+	const ScopeExitRun closeFp([&]() { if (fp) fclose(fp); fp = NULL; });
+	NpyShardManifest::Shard& shard = manifest.shards.back();
+	if (bFailed) {
+		// reopen the shard once the failed stream is closed,
+		// and cut it after the last complete row that reached the file
+		bFailed = false;
+		fclose(fp);
+		fp = fopen((GetFolder(manifestName) + shard.filename).c_str(), "r+b");
+		if (!fp)
+			return "error: unable to open file";
+		fseek(fp, 0, SEEK_END);
+		const size_t fileSize = (size_t)ftell(fp);
+		const size_t rowBytes = manifest.SizeRowBytes();
+		if (rowBytes > 0)
+			shard.numRows = std::min(shard.numRows, fileSize > headerSize ? (fileSize - headerSize) / rowBytes : size_t(0));
+		#ifdef _WIN32
+		if (_chsize_s(_fileno(fp), (__int64)(headerSize + shard.numRows * rowBytes)) != 0)
+		#else
+		if (ftruncate(fileno(fp), (off_t)(headerSize + shard.numRows * rowBytes)) != 0)
+		#endif
+			return "error: unable to resize file";
+	}
+	NpyArray::shape_t shape(1, shard.numRows);
+	shape.insert(shape.end(), manifest.rowShape.cbegin(), manifest.rowShape.cend());
+	const std::vector<char> header = NpyArray::CreateHeaderNPY(shape, manifest.type, manifest.wordSize, headerSize);
+	ASSERT(header.size() == headerSize);
+	fseek(fp, 0, SEEK_SET);
+	if (fwrite(header.data(), sizeof(char), header.size(), fp) != header.size() || fflush(fp) != 0)
+		return "error: failed fwrite";
+	// the shard must be on disk before the manifest lists it
+	#ifdef _WIN32
+	if (_commit(_fileno(fp)) != 0)
+	#else
+	if (fsync(fileno(fp)) != 0)
+	#endif
+		return "error: failed fsync";
+	return manifest.Save(manifestName);
+}
+
+
+LPCSTR NpyShardReader::Open(std::string manifestName, bool bMap)
+{
+	Close();
+	LPCSTR ret = manifest.Load(manifestName);
+	if (ret != NULL)
+		return ret;
+	#ifdef _WIN32
+	// memory mapping not supported, load the shards instead
+	bMap = false;
+	#endif
+	const std::string folder(GetFolder(manifestName));
+	shards.resize(manifest.shards.size());
+	shardRows.assign(1, 0);
+	for (size_t i = 0; i < shards.size(); ++i) {
+		const NpyShardManifest::Shard& shard = manifest.shards[i];
+		NpyArray& arr = shards[i];
+		ret = bMap ?
+			arr.MapNPY(folder + shard.filename) :
+			arr.LoadNPY(folder + shard.filename);
+		if (ret == NULL && (
+			arr.Shape().size() != manifest.rowShape.size()+1 || arr.Shape()[0] != shard.numRows ||
+			!std::equal(manifest.rowShape.cbegin(), manifest.rowShape.cend(), arr.Shape().cbegin()+1) ||
+			arr.SizeValueBytes() != manifest.wordSize || std::abs(arr.Type()) != manifest.type || arr.ColMajor()))
+			ret = "error: shard does not match the manifest";
+		if (ret != NULL) {
+			Close();
+			return ret;
+		}
+		shardRows.push_back(shardRows.back() + shard.numRows);
+	}
+	return NULL;
+}
+
+void NpyShardReader::Close()
+{
+	manifest = NpyShardManifest();
+	shards.clear();
+	shardRows.clear();
+}
+
+LPCSTR NpyShardReader::Read(size_t rowBegin, size_t numRows, NpyArray& arr) const
+{
+	if (rowBegin + numRows > NumRows())
+		return "error: rows out of range";
+	NpyArray::shape_t shape(1, numRows);
+	shape.insert(shape.end(), manifest.rowShape.cbegin(), manifest.rowShape.cend());
+	arr = NpyArray(shape, manifest.wordSize, manifest.type);
+	arr.Allocate();
+	const size_t rowBytes = manifest.SizeRowBytes();
+	uint8_t* dst = arr.Data();
+	size_t idx = std::upper_bound(shardRows.cbegin(), shardRows.cend(), rowBegin) - shardRows.cbegin() - 1;
+	while (numRows > 0) {
+		const size_t n = std::min(numRows, shardRows[idx+1] - rowBegin);
+		memcpy(dst, shards[idx].Data() + (rowBegin - shardRows[idx]) * rowBytes, n * rowBytes);
+		dst += n * rowBytes;
+		rowBegin += n;
+		numRows -= n;
+		++idx;
+	}
+	return NULL;
+}
+/*----------------------------------------------------------------*/
@@ -22,6 +22,12 @@
 #include <string>
 #include <map>
 #include <cmath>
+#include <future>
+#include <functional>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 
 
 // D E F I N E S ///////////////////////////////////////////////////
@@ -60,13 +66,33 @@ typedef const char* LPCSTR;
 
 // S T R U C T S ///////////////////////////////////////////////////
 
+class NpyBatchLoader;
+class NpyReader;
+class NpyShardWriter;
+
 class TINYNPY_LIB NpyArray {
+	friend class NpyBatchLoader;
+	friend class NpyReader;
+	friend class NpyShardWriter;
+
 public:
 	using shape_t = std::vector<size_t>;
 	using npz_t = std::map<std::string, NpyArray>;
+	using callback_t = std::function<void(LPCSTR)>;
+
+	// output policy flags
+	enum WRITE_FLAGS {
+		WRITE_DEFAULT = 0,
+		WRITE_DIRECT = (1<<0), // write the bulk of the file with O_DIRECT through an aligned bounce buffer
+		WRITE_PREALLOCATE = (1<<1), // reserve the file space before writing
+		WRITE_SYNC = (1<<2), // flush the file to disk before returning, and appended data before the updated header
+		WRITE_ATOMIC = (1<<3), // write a temporary file (a copy of the target when appending) and rename it over the target once synced
+	};
 
 private:
 	uint8_t* data;
+	uint8_t* mapping; // start of the memory mapped file, if the data lives in one
+	size_t mappingSize;
 	shape_t shape;
 	size_t numValues;
 	size_t wordSize;
@@ -74,21 +100,39 @@ private:
 	bool fortranOrder;
 
 public:
-	NpyArray() : data(NULL), numValues(0), wordSize(0), type(0), fortranOrder(0) {}
+	NpyArray() : data(NULL), mapping(NULL), mappingSize(0), numValues(0), wordSize(0), type(0), fortranOrder(0) {}
 
 	template <typename T>
 	NpyArray(const shape_t& _shape, T* _data, bool _fortranOrder=false)
-		: data((uint8_t*)_data), shape(_shape), numValues(NumValue(shape)), wordSize(sizeof(T)), type(-getTypeChar(typeid(T))), fortranOrder(_fortranOrder) {}
+		: data((uint8_t*)_data), mapping(NULL), mappingSize(0), shape(_shape), numValues(NumValue(shape)), wordSize(sizeof(T)), type(-getTypeChar(typeid(T))), fortranOrder(_fortranOrder) {}
 
 	NpyArray(const shape_t& _shape, size_t _wordSize, char _type, bool _fortranOrder=false)
-		: data(NULL), shape(_shape), numValues(NumValue(shape)), wordSize(_wordSize), type(_type), fortranOrder(_fortranOrder) {}
+		: data(NULL), mapping(NULL), mappingSize(0), shape(_shape), numValues(NumValue(shape)), wordSize(_wordSize), type(_type), fortranOrder(_fortranOrder) {}
 
 	NpyArray(NpyArray&& arr)
-		: data(arr.data), shape(std::move(arr.shape)), numValues(arr.numValues), wordSize(arr.wordSize), type(arr.type), fortranOrder(arr.fortranOrder) { arr.Clean(); }
+		: data(arr.data), mapping(arr.mapping), mappingSize(arr.mappingSize), shape(std::move(arr.shape)), numValues(arr.numValues), wordSize(arr.wordSize), type(arr.type), fortranOrder(arr.fortranOrder) { arr.Clean(); }
 
 	NpyArray(const NpyArray&) = delete;
 
-	~NpyArray() { if (OwnData()) delete[] data; }
+	~NpyArray() { Release(); }
+
+	NpyArray& operator=(NpyArray&& arr) {
+		if (this != &arr) {
+			Release();
+			data = arr.data;
+			mapping = arr.mapping;
+			mappingSize = arr.mappingSize;
+			shape = std::move(arr.shape);
+			numValues = arr.numValues;
+			wordSize = arr.wordSize;
+			type = arr.type;
+			fortranOrder = arr.fortranOrder;
+			arr.Clean();
+		}
+		return *this;
+	}
+
+	NpyArray& operator=(const NpyArray&) = delete;
 
 
 	bool IsEmpty() const {
@@ -97,6 +141,9 @@ public:
 	bool OwnData() const {
 		return type > 0;
 	}
+	bool IsMapped() const {
+		return mapping != NULL;
+	}
 	void Allocate() {
 		ASSERT(data == NULL && numValues > 0 && OwnData());
 		data = new uint8_t[SizeBytes()];
@@ -106,12 +153,16 @@ public:
 		data = const_cast<uint8_t*>(_data);
 	}
 	void Release() {
-		if (OwnData())
+		if (IsMapped())
+			Unmap();
+		else if (OwnData())
 			delete[] data;
 		Clean();
 	}
 	void Clean() {
 		data = NULL;
+		mapping = NULL;
+		mappingSize = 0;
 	}
 
 
@@ -180,23 +231,45 @@ public:
 	LPCSTR LoadNPZ(std::string filename, std::string varname);
 	static LPCSTR LoadNPZ(std::string filename, npz_t& arrays);
 
+	// asynchronous input: the load is run on the internal I/O thread pool
+	// and the result is reported through the returned future or the callback;
+	// the array(s) must not be accessed or destroyed until the load completes
+	std::future<LPCSTR> LoadNPYAsync(std::string filename);
+	std::future<LPCSTR> LoadNPZAsync(std::string filename, std::string varname);
+	static std::future<LPCSTR> LoadNPZAsync(std::string filename, npz_t& arrays);
+	void LoadNPYAsync(std::string filename, callback_t callback);
+	void LoadNPZAsync(std::string filename, std::string varname, callback_t callback);
+	static void LoadNPZAsync(std::string filename, npz_t& arrays, callback_t callback);
+
+
+	// memory mapped input/output: the array data is a shared mapping of the NPY file payload;
+	// read-only mappings must not be written to, and changes to writable mappings
+	// reach the file at the latest on Flush() or Release()
+	LPCSTR MapNPY(std::string filename, bool bWritable=false);
+	LPCSTR CreateMappedNPY(std::string filename, const shape_t& shape, size_t wordSize, char type);
+	template<typename T>
+	LPCSTR CreateMappedNPY(std::string filename, const shape_t& shape) {
+		return CreateMappedNPY(filename, shape, sizeof(T), getTypeChar(typeid(T)));
+	}
+	LPCSTR Flush(bool bAsync=false) const;
+
 
 	// output
-	LPCSTR SaveNPY(std::string filename, bool bAppend=false) const;
-	LPCSTR SaveNPZ(std::string zipname, std::string varname, bool bAppend=true) const;
+	LPCSTR SaveNPY(std::string filename, bool bAppend=false, unsigned flags=WRITE_DEFAULT) const;
+	LPCSTR SaveNPZ(std::string zipname, std::string varname, bool bAppend=true, unsigned flags=WRITE_DEFAULT) const;
 	template<typename T>
-	static LPCSTR SaveNPY(std::string filename, const std::vector<T>& data, shape_t shape=shape_t(), bool bAppend=false) {
+	static LPCSTR SaveNPY(std::string filename, const std::vector<T>& data, shape_t shape=shape_t(), bool bAppend=false, unsigned flags=WRITE_DEFAULT) {
 		if (shape.empty())
 			shape.push_back(data.size());
 		NpyArray arr(std::move(shape), const_cast<T*>(data.data()));
-		return arr.SaveNPY(filename, bAppend);
+		return arr.SaveNPY(filename, bAppend, flags);
 	}
 	template<typename T>
-	static LPCSTR SaveNPZ(std::string zipname, std::string varname, const std::vector<T>& data, shape_t shape=shape_t(), bool bAppend=true) {
+	static LPCSTR SaveNPZ(std::string zipname, std::string varname, const std::vector<T>& data, shape_t shape=shape_t(), bool bAppend=true, unsigned flags=WRITE_DEFAULT) {
 		if (shape.empty())
 			shape.push_back(data.size());
 		NpyArray arr(std::move(shape), const_cast<T*>(data.data()));
-		return arr.SaveNPZ(zipname, varname, bAppend);
+		return arr.SaveNPZ(zipname, varname, bAppend, flags);
 	}
 
 private:
@@ -204,16 +277,22 @@ private:
 		numValues = NumValue(shape);
 		Allocate();
 	}
+	void Unmap();
 
 	// input
+	static size_t SizeHeaderNPY(const uint8_t* buffer);
 	static LPCSTR ParseHeaderNPY(const std::string& header, shape_t& shape, size_t& wordSize, char& type, bool& fortranOrder);
 	static LPCSTR ParseHeaderNPY(const uint8_t* buffer, shape_t& shape, size_t& wordSize, char& type, bool& fortranOrder);
 	static LPCSTR ParseHeaderNPY(FILE* fp, shape_t& shape, size_t& wordSize, char& type, bool& fortranOrder);
+	static LPCSTR ParseFooterZIP(const char* footer, uint16_t& nrecs, size_t& global_header_size, size_t& global_header_offset);
 	static LPCSTR ParseFooterZIP(FILE* fp, uint16_t& nrecs, size_t& global_header_size, size_t& global_header_offset);
+	static LPCSTR ReadLocalHeaderZIP(FILE* fp, std::string& varname, uint16_t& comprMethod, uint32_t& comprBytes, uint32_t& uncomprBytes);
 	static LPCSTR LoadArrayNPZ(FILE* fp, std::string& varname, NpyArray& arr);
+	LPCSTR MapNPY(int fd, bool bWritable);
+	LPCSTR InflateNPZ(const uint8_t* bufferCompr, uint32_t comprBytes, uint32_t uncomprBytes);
 
 	// output
-	static std::vector<char> CreateHeaderNPY(const shape_t& shape, char type, size_t wordSize);
+	static std::vector<char> CreateHeaderNPY(const shape_t& shape, char type, size_t wordSize, size_t minSize=0);
 
 	static std::vector<char>& add(std::vector<char>& lhs, const std::string rhs) {
 		lhs.insert(lhs.end(), rhs.cbegin(), rhs.cend());
@@ -235,5 +314,218 @@ private:
 		return lhs;
 	}
 };
+/*----------------------------------------------------------------*/
+
+
+// Read arrays from a NPY or NPZ file opened only once: the NPZ directory is
+// indexed on open and all reads use positional I/O, so the same reader
+// can be shared by many threads loading arrays concurrently
+class TINYNPY_LIB NpyReader {
+	friend class NpyBatchLoader;
+public:
+	struct Entry {
+		size_t offset; // position of the NPY data in the file
+		size_t comprBytes;
+		size_t uncomprBytes;
+		uint16_t comprMethod;
+	};
+	using entries_t = std::map<std::string, Entry>;
+
+protected:
+	intptr_t fd; // file descriptor, or file HANDLE on Windows
+	size_t fileSize;
+	bool bNPZ;
+	entries_t entries; // arrays stored in the NPZ file
+
+public:
+	NpyReader() : fd(-1), fileSize(0), bNPZ(false) {}
+	~NpyReader() { Close(); }
+
+	NpyReader(const NpyReader&) = delete;
+	NpyReader& operator=(const NpyReader&) = delete;
+
+	LPCSTR Open(std::string filename);
+	void Close();
+
+	bool IsOpen() const {
+		return fd != -1;
+	}
+	bool IsNPZ() const {
+		return bNPZ;
+	}
+	const entries_t& Entries() const {
+		return entries;
+	}
+
+	// input; safe to call concurrently
+	LPCSTR LoadNPY(NpyArray& arr) const;
+	LPCSTR LoadNPZ(const std::string& varname, NpyArray& arr) const;
+	LPCSTR LoadNPZ(NpyArray::npz_t& arrays) const;
+
+protected:
+	LPCSTR ParseDirectoryZIP();
+	LPCSTR LoadArray(const Entry& entry, NpyArray& arr) const;
+	bool Read(void* buffer, size_t size, size_t offset) const;
+};
+/*----------------------------------------------------------------*/
+
+
+// Load batches of same-shaped arrays stored in many NPY files or NPZ members:
+// the arrays of a batch are read by the I/O thread pool directly into one
+// contiguous array of shape (numItems, sampleShape...), while up to
+// numPrefetch batches are loaded ahead of the one being consumed
+class TINYNPY_LIB NpyBatchLoader {
+public:
+	struct Item {
+		std::string filename;
+		std::string varname; // name of the array in the NPZ file, empty for NPY files
+		Item(std::string _filename, std::string _varname=std::string())
+			: filename(std::move(_filename)), varname(std::move(_varname)) {}
+	};
+	using items_t = std::vector<Item>;
+
+protected:
+	struct Batch {
+		NpyArray arr;
+		size_t numPending; // number of items still loading
+		LPCSTR ret; // first error encountered while loading the items
+	};
+
+	const items_t items;
+	const size_t batchSize;
+	const size_t numPrefetch;
+	const bool bShuffle;
+	const unsigned seed;
+	unsigned epoch;
+	std::vector<size_t> order; // items order for the current epoch
+	size_t nextItem; // first item in order not scheduled yet
+	NpyArray::shape_t sampleShape;
+	size_t wordSize;
+	char type;
+	std::map<std::string, std::unique_ptr<NpyReader>> archives; // NPZ files opened and indexed once
+	std::deque<std::unique_ptr<Batch>> batches;
+	std::mutex mtx;
+	std::condition_variable cv;
+
+public:
+	NpyBatchLoader(items_t items, size_t batchSize, size_t numPrefetch=2, bool bShuffle=false, unsigned seed=0);
+	~NpyBatchLoader();
+
+	NpyBatchLoader(const NpyBatchLoader&) = delete;
+	NpyBatchLoader& operator=(const NpyBatchLoader&) = delete;
+
+	size_t NumItems() const {
+		return items.size();
+	}
+	size_t NumBatches() const {
+		return (items.size() + batchSize - 1) / batchSize;
+	}
+	// shape of one item, valid after the first call to Next()
+	const NpyArray::shape_t& SampleShape() const {
+		return sampleShape;
+	}
+
+	// get the next batch; returns NULL and an empty batch once all items were loaded
+	LPCSTR Next(NpyArray& batch);
+	// start a new pass over the items, shuffling them again if requested
+	void Reset();
+
+protected:
+	LPCSTR Init();
+	void Shuffle();
+	void Schedule();
+	void Wait();
+	LPCSTR OpenItem(const Item& item, NpyReader& file, const NpyReader*& pReader, NpyReader::Entry& entry) const;
+	static LPCSTR ReadHeader(const NpyReader& reader, const NpyReader::Entry& entry, NpyArray::shape_t& shape, size_t& wordSize, char& type, bool& fortranOrder, size_t& headerSize);
+	LPCSTR LoadItem(const Item& item, uint8_t* dst) const;
+};
+/*----------------------------------------------------------------*/
+
+
+// Array stored as a sequence of NPY shards concatenated along the first axis;
+// the manifest is a small text file listing the data type, the shape of one row
+// and the shard files (relative to the manifest folder) with their row counts
+struct TINYNPY_LIB NpyShardManifest {
+	struct Shard {
+		std::string filename;
+		size_t numRows;
+	};
+	std::vector<Shard> shards;
+	NpyArray::shape_t rowShape;
+	size_t wordSize;
+	char type;
+
+	NpyShardManifest() : wordSize(0), type(0) {}
+
+	size_t NumRows() const;
+	size_t SizeRowBytes() const {
+		return NpyArray::NumValue(rowShape) * wordSize;
+	}
+
+	LPCSTR Load(std::string filename);
+	LPCSTR Save(std::string filename) const;
+};
+
+// Append rows to a sharded array, starting a new shard
+// each time the current one reaches the maximum size
+class TINYNPY_LIB NpyShardWriter {
+protected:
+	std::string manifestName;
+	size_t maxShardBytes;
+	NpyShardManifest manifest;
+	FILE* fp; // current shard
+	size_t headerSize; // size reserved for the header of the current shard
+	bool bFailed; // a write to the current shard failed
+
+public:
+	NpyShardWriter() : maxShardBytes(0), fp(NULL), headerSize(0), bFailed(false) {}
+	~NpyShardWriter() { Close(); }
+
+	NpyShardWriter(const NpyShardWriter&) = delete;
+	NpyShardWriter& operator=(const NpyShardWriter&) = delete;
+
+	// create a new sharded array or, if bAppend, continue an existing one in a new shard
+	LPCSTR Open(std::string manifestName, size_t maxShardBytes, bool bAppend=false);
+	// append the rows of the given array (of shape (numRows, rowShape...))
+	LPCSTR Append(const NpyArray& rows);
+	// complete the current shard and write the manifest
+	LPCSTR Close();
+
+	const NpyShardManifest& Manifest() const {
+		return manifest;
+	}
+
+protected:
+	LPCSTR OpenShard();
+	LPCSTR CloseShard();
+};
+
+// Access a sharded array as one virtual array;
+// the shards are memory mapped or else loaded in memory
+class TINYNPY_LIB NpyShardReader {
+protected:
+	NpyShardManifest manifest;
+	std::vector<NpyArray> shards;
+	std::vector<size_t> shardRows; // index of the first row of each shard, followed by the total number of rows
+
+public:
+	LPCSTR Open(std::string manifestName, bool bMap=true); // loaded on platforms without memory mapping
+	void Close();
+
+	const NpyShardManifest& Manifest() const {
+		return manifest;
+	}
+	size_t NumRows() const {
+		return shardRows.empty() ? 0 : shardRows.back();
+	}
+	const NpyArray& Shard(size_t idx) const {
+		return shards[idx];
+	}
+
+	// copy the given range of rows, possibly spanning several shards,
+	// in the given array of shape (numRows, rowShape...)
+	LPCSTR Read(size_t rowBegin, size_t numRows, NpyArray& arr) const;
+};
+/*----------------------------------------------------------------*/
 
 #endif // __SEACAVE_NPY_H__